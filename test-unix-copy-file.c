@@ -12,9 +12,11 @@
 #include <string.h>
 
 #include <fcntl.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "unix-copy-file.h"
@@ -171,6 +173,18 @@ static void test_unix_fcopy_file(void)
     test(has_same_perms_fd(valid_fd1, valid_fd2));
     test(has_same_contents(temp1, temp2));
 
+    /* dest_fd was opened with O_APPEND. */
+    int append_fd;
+
+    fatal(ftruncate(valid_fd2, 0) == -1,
+        "error: failed to truncate temporary file: %s.\n", strerror(errno));
+    fatal((append_fd = open(temp2, O_WRONLY | O_APPEND)) == -1,
+        "error: failed to open: \"%s\": %s.\n", temp2, strerror(errno));
+    test(unix_fcopy_file(valid_fd1, append_fd, UNIX_OVERWRITE_EXISTING));
+    test(has_same_contents(temp1, temp2));
+
+    close(append_fd);
+
     fatal(unlink(temp1) == -1, "error: failed to unlink: \"%s\": %s.\n", temp1,
         strerror(errno)); 
     fatal(unlink(temp2) == -1, "error: failed to unlink: \"%s\": %s.\n", temp2,
@@ -226,10 +240,447 @@ static void test_unix_copy_file(void)
           valid_path2, strerror(errno));
 }
 
+static void test_unix_fcopy_file_range(void)
+{
+    static char temp1[] = "Words-words-words.XXXXXX";
+    static char temp2[] = "Though-this-be-madness.XXXXXX";
+    const int valid_fd1 = create_temp_file(temp1);
+    const int valid_fd2 = create_temp_file(temp2);
+    const int invalid_fd = -1;
+
+    /* Invalid src_fd or dest_fd. */
+    test(unix_fcopy_file_range(invalid_fd, 0, valid_fd2, 0, 1, UNIX_NONE) == -1);
+    test(unix_fcopy_file_range(valid_fd1, 0, invalid_fd, 0, 1, UNIX_NONE) == -1);
+
+    /* src_fd or dest_fd is not a regular file or symbolic link. */
+    test(unix_fcopy_file_range(STDOUT_FILENO, 0, valid_fd2, 0, 1, UNIX_NONE) == -1);
+    test(unix_fcopy_file_range(valid_fd1, 0, STDOUT_FILENO, 0, 1, UNIX_NONE) == -1);
+
+    /* Negative offsets. */
+    test(unix_fcopy_file_range(valid_fd1, -1, valid_fd2, 0, 1, UNIX_NONE) == -1);
+    test(unix_fcopy_file_range(valid_fd1, 0, valid_fd2, -1, 1, UNIX_NONE) == -1);
+
+    /* Both UNIX_SYNCHRONIZE and UNIX_DATA_SYNCHRONIZE specified. */
+    test(unix_fcopy_file_range(valid_fd1, 0, valid_fd2, 0, 1, 
+            UNIX_SYNCHRONIZE | UNIX_SYNCHRONIZE_DATA) == -1);
+
+    /* src_fd and dest_fd are equivalent. */
+    test(unix_fcopy_file_range(valid_fd1, 0, valid_fd1, 0, 1, UNIX_NONE) == -1);
+
+    fatal(write(valid_fd1, "0123456789", 10) < 10,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    fatal(write(valid_fd2, "abcdefghij", 10) < 10,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+
+    /* Copy a range from the middle to a different offset. */
+    test(unix_fcopy_file_range(valid_fd1, 2, valid_fd2, 5, 3, UNIX_SYNCHRONIZE_DATA) == 3);
+
+    char buf[32] = {};
+
+    fatal(pread(valid_fd2, buf, sizeof buf - 1, 0) == -1,
+        "error: failed to read temporary file: %s.\n", strerror(errno));
+    test(strcmp(buf, "abcde234ij") == 0);
+
+    /* A range past the end of the source is cut short, and extends dest. */
+    test(unix_fcopy_file_range(valid_fd1, 6, valid_fd2, 8, 100, UNIX_NONE) == 4);
+    test(unix_fcopy_file_range(valid_fd1, 10, valid_fd2, 0, 100, UNIX_NONE) == 0);
+
+    memset(buf, 0, sizeof buf);
+    fatal(pread(valid_fd2, buf, sizeof buf - 1, 0) == -1,
+        "error: failed to read temporary file: %s.\n", strerror(errno));
+    test(strcmp(buf, "abcde2346789") == 0);
+
+    /* Seek positions are not modified. */
+    test(lseek(valid_fd1, 0, SEEK_CUR) == 10);
+    test(lseek(valid_fd2, 0, SEEK_CUR) == 10);
+
+    /* dest_fd was opened with O_APPEND, so dest_off could not be honoured. */
+    int append_fd;
+
+    fatal((append_fd = open(temp2, O_WRONLY | O_APPEND)) == -1,
+        "error: failed to open: \"%s\": %s.\n", temp2, strerror(errno));
+    test(unix_fcopy_file_range(valid_fd1, 0, append_fd, 2, 2, UNIX_NONE) == -1);
+
+    memset(buf, 0, sizeof buf);
+    fatal(pread(valid_fd2, buf, sizeof buf - 1, 0) == -1,
+        "error: failed to read temporary file: %s.\n", strerror(errno));
+    test(strcmp(buf, "abcde2346789") == 0);
+
+    close(append_fd);
+
+    fatal(unlink(temp1) == -1, "error: failed to unlink: \"%s\": %s.\n", temp1,
+        strerror(errno)); 
+    fatal(unlink(temp2) == -1, "error: failed to unlink: \"%s\": %s.\n", temp2,
+        strerror(errno));
+
+    close(valid_fd1);
+    close(valid_fd2);
+}
+
+static void test_unix_fappend_file(void)
+{
+    static char temp1[] = "Something-is-rotten.XXXXXX";
+    static char temp2[] = "In-the-state-of-Denmark.XXXXXX";
+    const int valid_fd1 = create_temp_file(temp1);
+    const int valid_fd2 = create_temp_file(temp2);
+
+    /* Negative since. */
+    test(unix_fappend_file(valid_fd1, valid_fd2, -1, UNIX_NONE) == -1);
+
+    /* since is past the end of the source. */
+    test(unix_fappend_file(valid_fd1, valid_fd2, 1, UNIX_NONE) == -1);
+
+    /* src_fd and dest_fd are equivalent. */
+    test(unix_fappend_file(valid_fd1, valid_fd1, 0, UNIX_NONE) == -1);
+
+    /* Nothing to copy yet. */
+    test(unix_fappend_file(valid_fd1, valid_fd2, 0, UNIX_NONE) == 0);
+
+    /* since is past the end of the destination. */
+    fatal(write(valid_fd1, "first ", 6) < 6,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    test(unix_fappend_file(valid_fd1, valid_fd2, 6, UNIX_NONE) == -1);
+    fatal(ftruncate(valid_fd1, 0) == -1 || lseek(valid_fd1, 0, SEEK_SET) == -1,
+        "error: failed to truncate temporary file: %s.\n", strerror(errno));
+
+    fatal(write(valid_fd1, "first line\n", 11) < 11,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    test(unix_fappend_file(valid_fd1, valid_fd2, 0, UNIX_NONE) == 11);
+
+    fatal(write(valid_fd1, "second line\n", 12) < 12,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    test(unix_fappend_file(valid_fd1, valid_fd2, 11, UNIX_SYNCHRONIZE) == 12);
+    test(has_same_contents(temp1, temp2));
+
+    /* A stale tail in the destination is truncated. */
+    fatal(pwrite(valid_fd2, "stale tail\n", 11, 23) < 11,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    test(unix_fappend_file(valid_fd1, valid_fd2, 23, UNIX_NONE) == 0);
+    test(has_same_contents(temp1, temp2));
+
+    /* dest_fd was opened with O_APPEND. With a stale tail in the destination,
+     * the new bytes would be appended after the tail, and then truncated
+     * away. */
+    int append_fd;
+
+    fatal(pwrite(valid_fd2, "stale tail\n", 11, 23) < 11,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    fatal((append_fd = open(temp2, O_WRONLY | O_APPEND)) == -1,
+        "error: failed to open: \"%s\": %s.\n", temp2, strerror(errno));
+    fatal(write(valid_fd1, "third line\n", 11) < 11,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    test(unix_fappend_file(valid_fd1, append_fd, 23, UNIX_NONE) == -1);
+
+    /* The destination was left alone. */
+    char buf[64] = {};
+
+    fatal(pread(valid_fd2, buf, sizeof buf - 1, 0) == -1,
+        "error: failed to read temporary file: %s.\n", strerror(errno));
+    test(strcmp(buf, "first line\nsecond line\nstale tail\n") == 0);
+
+    /* Without O_APPEND, the stale tail is replaced. */
+    test(unix_fappend_file(valid_fd1, valid_fd2, 23, UNIX_NONE) == 11);
+    test(has_same_contents(temp1, temp2));
+
+    close(append_fd);
+
+    fatal(unlink(temp1) == -1, "error: failed to unlink: \"%s\": %s.\n", temp1,
+        strerror(errno)); 
+    fatal(unlink(temp2) == -1, "error: failed to unlink: \"%s\": %s.\n", temp2,
+        strerror(errno));
+
+    close(valid_fd1);
+    close(valid_fd2);
+}
+
+/**
+ * Sets the access and modification times of path to seconds_ago seconds ago. This
+ * also sets its status change time to now. */
+static void backdate(const char path[static 1], time_t seconds_ago)
+{
+    const struct timespec times[2] = {
+        { .tv_sec = time(nullptr) - seconds_ago },
+        { .tv_sec = time(nullptr) - seconds_ago },
+    };
+
+    fatal(utimensat(AT_FDCWD, path, times, 0) == -1,
+        "error: failed to set timestamps: \"%s\": %s.\n", path, strerror(errno));
+}
+
+/* While no file descriptors are free, open() fails. A call to
+ * unix_copy_file_manifest() that succeeds in that state cannot have opened the
+ * source file. */
+static int spare_fds[64];
+static size_t spare_fd_count;
+static struct rlimit saved_nofile;
+
+static void exhaust_fds(void)
+{
+    fatal(getrlimit(RLIMIT_NOFILE, &saved_nofile) == -1
+            || setrlimit(RLIMIT_NOFILE, 
+                &(struct rlimit) { .rlim_cur = 64, .rlim_max = saved_nofile.rlim_max }) == -1,
+        "error: failed to lower RLIMIT_NOFILE: %s.\n", strerror(errno));
+
+    for (spare_fd_count = 0; spare_fd_count < 64; ++spare_fd_count) {
+        if ((spare_fds[spare_fd_count] = dup(STDERR_FILENO)) == -1) {
+            break;
+        }
+    }
+
+    fatal(spare_fd_count == 64, "error: %zu file descriptors are still free.\n", 
+        spare_fd_count);
+}
+
+static void release_fds(void)
+{
+    while (spare_fd_count > 0) {
+        close(spare_fds[--spare_fd_count]);
+    }
+
+    fatal(setrlimit(RLIMIT_NOFILE, &saved_nofile) == -1,
+        "error: failed to restore RLIMIT_NOFILE: %s.\n", strerror(errno));
+}
+
+static void test_unix_copy_file_manifest(void)
+{
+    static char manifest_path[] = "Brevity-is-the-soul-of-wit.XXXXXX";
+    static char src_path[] = "More-matter-with-less-art.XXXXXX";
+    static char dest_path[] = "Madam-I-swear-I-use-no-art.XXXXXX";
+    const int manifest_fd = create_temp_file(manifest_path);
+    const int src_fd = create_temp_file(src_path);
+    const int dest_fd = create_temp_file(dest_path);
+
+    close(manifest_fd);
+
+    struct unix_manifest *manifest = unix_manifest_open(manifest_path);
+
+    test(manifest);
+
+#ifdef __linux__
+    /* The manifest is already open. */
+    test(!unix_manifest_open(manifest_path));
+#endif  /* __linux__ */
+
+    /* Both UNIX_SKIP_EXISTING and UNIX_OVERWRITE_EXISTING specified. */
+    test(!unix_copy_file_manifest(manifest, src_path, dest_path, 
+            UNIX_OVERWRITE_EXISTING | UNIX_SKIP_EXISTING));
+
+    /* src_path is not a regular file. */
+    test(!unix_copy_file_manifest(manifest, NOT_ISREG_OR_ISLNK, dest_path, 
+            UNIX_OVERWRITE_EXISTING));
+
+    /* Backdate the source, so that its timestamps can be trusted. */
+    fatal(write(src_fd, "Though this be madness, yet there is method in't.\n", 51) < 51,
+        "error: failed to populate temporary file: %s.\n", strerror(errno));
+    backdate(src_path, 3600);
+
+    /* First copy. */
+    test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    test(has_same_contents(src_path, dest_path));
+
+    /* The source is unchanged, so it is skipped without being opened, and the
+     * destination is not written to even if it was modified behind the
+     * manifest's back. */
+    fatal(pwrite(dest_fd, "X", 1, 0) < 1,
+        "error: failed to modify temporary file: %s.\n", strerror(errno));
+    exhaust_fds();
+    test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    release_fds();
+    test(!has_same_contents(src_path, dest_path));
+
+    /* Only the timestamps of the source changed. It must be opened to find out
+     * that its contents did not, but is not copied. */
+    backdate(src_path, 1800);
+    exhaust_fds();
+    test(!unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    release_fds();
+    test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    test(!has_same_contents(src_path, dest_path));
+
+    /* Its new timestamps were recorded. */
+    exhaust_fds();
+    test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    release_fds();
+
+    /* The manifest survives being closed and reopened. */
+    test(unix_manifest_close(manifest));
+    manifest = unix_manifest_open(manifest_path);
+    test(manifest);
+    exhaust_fds();
+    test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    release_fds();
+    test(!has_same_contents(src_path, dest_path));
+
+    /* A manifest that was not closed, as if the process had crashed, is
+     * discarded. */
+    test(unix_manifest_close(manifest));
+
+    switch (fork()) {
+        case -1: 
+            fatal(true, "error: failed to fork child: %s.\n", strerror(errno));
+
+        case 0:  
+            _Exit(unix_manifest_open(manifest_path) ? EXIT_SUCCESS : EXIT_FAILURE);
+
+        default: 
+            int status; 
+            
+            fatal(wait(&status) == -1, "error: could not wait for child: %s.\n",
+                strerror(errno));
+            test(WIFEXITED(status) != 0 && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    manifest = unix_manifest_open(manifest_path);
+    test(manifest);
+    exhaust_fds();
+    test(!unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    release_fds();
+    test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    test(has_same_contents(src_path, dest_path));
+
+    /* A changed source is copied again, and a shorter one leaves no stale
+     * tail behind. */
+    fatal(ftruncate(src_fd, 0) == -1 || pwrite(src_fd, "Words.\n", 7, 0) < 7,
+        "error: failed to modify temporary file: %s.\n", strerror(errno));
+    test(unix_copy_file_manifest(manifest, src_path, dest_path, 
+            UNIX_OVERWRITE_EXISTING | UNIX_SYNCHRONIZE_DATA));
+    test(has_same_contents(src_path, dest_path));
+
+    /* A hard link to the source, copied to a different destination, gets a
+     * record of its own. */
+    static char link_path[] = "To-thine-own-self-be-true.XXXXXX";
+    static char link_dest_path[] = "This-above-all.XXXXXX";
+
+    close(create_temp_file(link_path));
+    close(create_temp_file(link_dest_path));
+    fatal(unlink(link_path) == -1 || link(src_path, link_path) == -1 
+            || unlink(link_dest_path) == -1,
+        "error: failed to link: \"%s\": %s.\n", link_path, strerror(errno));
+    test(unix_copy_file_manifest(manifest, link_path, link_dest_path, UNIX_OVERWRITE_EXISTING));
+    test(has_same_contents(src_path, link_dest_path));
+
+    fatal(unlink(link_path) == -1 || unlink(link_dest_path) == -1,
+        "error: failed to unlink: \"%s\": %s.\n", link_path, strerror(errno));
+
+    test(unix_manifest_close(manifest));
+    test(unix_manifest_close(nullptr));
+
+    fatal(unlink(manifest_path) == -1, "error: failed to unlink: \"%s\": %s.\n", 
+        manifest_path, strerror(errno)); 
+    fatal(unlink(src_path) == -1, "error: failed to unlink: \"%s\": %s.\n", 
+        src_path, strerror(errno)); 
+    fatal(unlink(dest_path) == -1, "error: failed to unlink: \"%s\": %s.\n", 
+        dest_path, strerror(errno));
+
+    close(src_fd);
+    close(dest_fd);
+}
+
+static void test_unix_manifest_grow(void)
+{
+    /* More than the 768 records that fit in the smallest table. */
+    enum { FILE_COUNT = 1000 };
+
+    static char dir[] = "The-rest-is-silence.XXXXXX";
+    char manifest_path[64];
+    char src_path[64];
+    char dest_path[64];
+
+    fatal(!mkdtemp(dir), "error: failed to create temporary directory: %s.\n", 
+        strerror(errno));
+    snprintf(manifest_path, sizeof manifest_path, "%s/manifest", dir);
+
+    struct unix_manifest *manifest = unix_manifest_open(manifest_path);
+
+    test(manifest);
+
+    for (int i = 0; i < FILE_COUNT; ++i) {
+        snprintf(src_path, sizeof src_path, "%s/src-%d", dir, i);
+        snprintf(dest_path, sizeof dest_path, "%s/dest-%d", dir, i);
+
+        const int fd = open(src_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+        fatal(fd == -1 || write(fd, &i, sizeof i) < (ssize_t) sizeof i,
+            "error: failed to populate temporary file: \"%s\": %s.\n", src_path, 
+            strerror(errno));
+        close(fd);
+        backdate(src_path, 3600);
+        test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    }
+
+    test(unix_manifest_close(manifest));
+
+    /* Every file was recorded, across all the times the table grew. */
+    manifest = unix_manifest_open(manifest_path);
+    test(manifest);
+    exhaust_fds();
+
+    for (int i = 0; i < FILE_COUNT; ++i) {
+        snprintf(src_path, sizeof src_path, "%s/src-%d", dir, i);
+        snprintf(dest_path, sizeof dest_path, "%s/dest-%d", dir, i);
+        test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    }
+
+    release_fds();
+    test(unix_manifest_close(manifest));
+
+    /* Only the first 100 files are copied in the next run, and pruning drops
+     * the rest, shrinking the manifest. */
+    struct stat before;
+    struct stat after;
+
+    fatal(stat(manifest_path, &before) == -1, "error: failed to stat: \"%s\": %s.\n", 
+        manifest_path, strerror(errno));
+
+    manifest = unix_manifest_open(manifest_path);
+    test(manifest);
+
+    for (int i = 0; i < 100; ++i) {
+        snprintf(src_path, sizeof src_path, "%s/src-%d", dir, i);
+        snprintf(dest_path, sizeof dest_path, "%s/dest-%d", dir, i);
+        test(unix_copy_file_manifest(manifest, src_path, dest_path, UNIX_OVERWRITE_EXISTING));
+    }
+
+    test(unix_manifest_prune(manifest));
+    test(unix_manifest_close(manifest));
+
+    fatal(stat(manifest_path, &after) == -1, "error: failed to stat: \"%s\": %s.\n", 
+        manifest_path, strerror(errno));
+    test(after.st_size < before.st_size);
+
+    manifest = unix_manifest_open(manifest_path);
+    test(manifest);
+    exhaust_fds();
+
+    for (int i = 0; i < FILE_COUNT; ++i) {
+        snprintf(src_path, sizeof src_path, "%s/src-%d", dir, i);
+        snprintf(dest_path, sizeof dest_path, "%s/dest-%d", dir, i);
+        test(unix_copy_file_manifest(manifest, src_path, dest_path, 
+                UNIX_OVERWRITE_EXISTING) == (i < 100));
+    }
+
+    release_fds();
+    test(unix_manifest_close(manifest));
+
+    for (int i = 0; i < FILE_COUNT; ++i) {
+        snprintf(src_path, sizeof src_path, "%s/src-%d", dir, i);
+        snprintf(dest_path, sizeof dest_path, "%s/dest-%d", dir, i);
+        fatal(unlink(src_path) == -1 || unlink(dest_path) == -1,
+            "error: failed to unlink: \"%s\": %s.\n", src_path, strerror(errno));
+    }
+
+    fatal(unlink(manifest_path) == -1 || rmdir(dir) == -1,
+        "error: failed to remove: \"%s\": %s.\n", dir, strerror(errno));
+}
+
 int main(void)
 {
     test_unix_fcopy_file();
     test_unix_copy_file();
+    test_unix_fcopy_file_range();
+    test_unix_fappend_file();
+    test_unix_copy_file_manifest();
+    test_unix_manifest_grow();
 
     return EXIT_SUCCESS;
 }
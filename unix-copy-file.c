@@ -1,5 +1,5 @@
 #ifdef __linux__
-    #define _GNU_SOURCE    /* For Linux's fallocate(). */
+    #define _GNU_SOURCE    /* For Linux's fallocate() and copy_file_range(). */
     #define HAVE_FALLOCATE 1
 #endif  /* __linux__ */
 
@@ -11,8 +11,14 @@
 #include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -23,6 +29,13 @@
     #define HAVE_FDATASYNC 1
 #endif /* defined(_POSIX_SYNCHRONIZED_IO) && _POSIX_SYNCHRONIZED_IO > 0 */
 
+/* copy_file_range() was added in Linux 4.5 and glibc 2.27. Kernels that lack
+ * it fail with ENOSYS, which we handle by falling back to the buffered path. */
+#if defined(__linux__) && defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    #define HAVE_COPY_FILE_RANGE 1
+#endif /* defined(__linux__) && defined(__GLIBC__) ... */
+
 #if defined(__GNUC__) || defined(__clang__) || defined(__INTEL_LLVM_COMPILER)
     #define unlikely(EXPR)  __builtin_expect(!!(EXPR), 0)
     #define likely(EXPR)    __builtin_expect(!!(EXPR), 1)
@@ -106,34 +119,35 @@ static int close_eintr(int fd)
 #endif  /* defined(__hpux) */
 }
 
-static ssize_t read_eintr(int fd, void *buf, size_t size)
+static ssize_t pread_eintr(int fd, void *buf, size_t size, off_t off)
 {
     ssize_t ret = 0;
 
     do {
-        ret = read(fd, buf, size);
+        ret = pread(fd, buf, size, off);
     } while (unlikely(ret == -1) && errno == EINTR);
 
     return ret;
 }
 
-static ssize_t write_eintr(int fd, const void *buf, size_t size)
+static ssize_t pwrite_eintr(int fd, const void *buf, size_t size, off_t off)
 {
     ssize_t ret = 0;
 
     do {
-        ret = write(fd, buf, size);
+        ret = pwrite(fd, buf, size, off);
     } while (unlikely(ret == -1) && errno == EINTR);
 
     return ret;
 }
 
-static ssize_t write_all(int fd, const void *buf, size_t size)
+static ssize_t pwrite_all(int fd, const void *buf, size_t size, off_t off)
 {
     size_t wcount = 0;
 
     while (wcount < size) {
-        ssize_t ret = write_eintr(fd, (char *) buf + wcount, size - wcount);
+        ssize_t ret = pwrite_eintr(fd, (char *) buf + wcount, size - wcount, 
+                                   off + (off_t) wcount);
 
         if (unlikely(ret == -1)) {
             return -1;
@@ -145,6 +159,97 @@ static ssize_t write_all(int fd, const void *buf, size_t size)
     return (ssize_t) wcount;
 }
 
+#ifdef HAVE_COPY_FILE_RANGE
+/**
+ * Returns true if a copy_file_range() failure with error code err means that
+ * the kernel or filesystem cannot offload this copy, and that it should be
+ * retried with read/write. */
+[[gnu::always_inline, gnu::const]] static inline bool is_offload_unsupported(int err)
+{
+    /* ENOSYS: Kernel older than 4.5.
+     * EXDEV:  Cross-filesystem copy on kernels older than 5.3, or between
+     *         filesystems that do not support it.
+     * EOPNOTSUPP, EINVAL: Filesystem does not support the operation, or one of
+     *         the files is special (e.g. procfs, sysfs).
+     * EBADF:  The destination was opened with O_APPEND.
+     * ETXTBSY, EPERM: Refused for reasons that may not apply to write(), e.g.
+     *         swap files, or policies of some filesystems. coreutils cp(1)
+     *         falls back on these too. */
+    return err == ENOSYS || err == EXDEV || err == EOPNOTSUPP || err == EINVAL
+        || err == EBADF || err == ETXTBSY || err == EPERM;
+}
+#endif  /* HAVE_COPY_FILE_RANGE */
+
+/**
+ * Copies at most len bytes from src_fd starting at src_off to dest_fd starting
+ * at dest_off, stopping early at the end of the source file. Neither file's
+ * seek position is used or modified.
+ *
+ * Where available, the copy is first offloaded to the kernel with
+ * copy_file_range(), which avoids transferring data to and from user space and
+ * lets filesystems that support it share extents (reflinks) or perform the
+ * copy server-side. Whatever remains is copied with pread()/pwrite().
+ *
+ * Returns the number of bytes copied, or -1 on error. */
+static ssize_t copy_range(int src_fd, off_t src_off, int dest_fd, off_t dest_off, size_t len)
+{
+    size_t total = 0;
+
+#ifdef HAVE_COPY_FILE_RANGE
+    while (total < len) {
+        /* copy_file_range() advances src_off and dest_off for us. */
+        ssize_t ret = copy_file_range(src_fd, &src_off, dest_fd, &dest_off,
+                                      len - total, 0);
+
+        if (unlikely(ret == -1)) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (is_offload_unsupported(errno)) {
+                break;
+            }
+
+            return -1;
+        }
+
+        /* Either the end of the file, or a filesystem that reports files as
+         * empty (e.g. procfs). Let the buffered path tell the two apart. */
+        if (ret == 0) {
+            break;
+        }
+
+        total += (size_t) ret;
+    }
+#endif  /* HAVE_COPY_FILE_RANGE */
+
+    /* Buffer size is selected to minimize the overhead from system calls.
+     * The value is picked based on coreutils cp(1) benchmarking data described
+     * here:
+     * https://github.com/coreutils/coreutils/blob/d1b0257077c0b0f0ee25087efd46270345d1dd1f/src/ioblksize.h#L23-L72 */
+    char buf[256u * 1024u];
+
+    while (total < len) {
+        const size_t want = len - total < sizeof buf ? len - total : sizeof buf;
+        const ssize_t rcount = pread_eintr(src_fd, buf, want, src_off);
+
+        if (rcount == 0) {
+            break;
+        }
+
+        if (rcount == -1 
+            || pwrite_all(dest_fd, buf, (size_t) rcount, dest_off) == -1) {
+            return -1;
+        }
+
+        src_off += rcount;
+        dest_off += rcount;
+        total += (size_t) rcount;
+    }
+
+    return (ssize_t) total;
+}
+
 /**
  * Flushes buffered data written to the file to permanent storage. */
 static int fdatasync_eintr(int fd)
@@ -162,6 +267,34 @@ static int fdatasync_eintr(int fd)
 #endif  /* defined(HAVE_FDATASYNC) && !(defined(__APPLE__) && defined(__DARWIN__) && defined(F_FULLSYNC) */
 }
 
+/**
+ * Returns false if options contains more than one option from either of the
+ * mutually exclusive groups. */
+[[gnu::always_inline, gnu::const]] static inline bool are_options_valid(unsigned char options)
+{
+    return !(((options & UNIX_SKIP_EXISTING) != UNIX_NONE 
+                && (options & UNIX_OVERWRITE_EXISTING) != UNIX_NONE)
+             || ((options & UNIX_SYNCHRONIZE) != UNIX_NONE 
+                && (options & UNIX_SYNCHRONIZE_DATA) != UNIX_NONE));
+}
+
+/**
+ * Synchronizes the data written to fd, and with UNIX_SYNCHRONIZE its attributes
+ * too, with permanent storage as requested by options. Does nothing if options
+ * requests neither. */
+static bool sync_dest(int fd, unsigned char options)
+{
+    if ((options & UNIX_SYNCHRONIZE_DATA) != UNIX_NONE) {
+        return fdatasync_eintr(fd) != -1;
+    }
+
+    if ((options & UNIX_SYNCHRONIZE) != UNIX_NONE) {
+        return fsync_eintr(fd) != -1;
+    }
+
+    return true;
+}
+
 [[gnu::always_inline]] static inline bool set_file_perms(int fd, mode_t m)
 {
     return fchmod(fd, m) != -1;
@@ -172,10 +305,7 @@ bool unix_fcopy_file(int src_fd, int dest_fd, unsigned char options)
     /* The behavior of C++'s filesystem::copy_file is undefined if there is more
      * than one option in any of options option group present in the valid
      * option groups, and perhaps Boost too. We define it and return false. */
-    if (((options & UNIX_SKIP_EXISTING) != UNIX_NONE 
-            && (options & UNIX_OVERWRITE_EXISTING) != UNIX_NONE)
-        || ((options & UNIX_SYNCHRONIZE) != UNIX_NONE 
-            && (options & UNIX_SYNCHRONIZE_DATA) != UNIX_NONE)) {
+    if (!are_options_valid(options)) {
         return false;
     }
 
@@ -207,50 +337,126 @@ bool unix_fcopy_file(int src_fd, int dest_fd, unsigned char options)
 
     posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-    /* Save the original seek position of both src_fd and dest_fd. We shall seek
-     * to restore them before returning in either failure or success case. 
+    /* Copy from the current seek position of src_fd to the current seek
+     * position of dest_fd. copy_range() uses positional I/O, so both seek
+     * positions are left untouched.
      *
      * Do not check for errors as none from EBADF, EINVAL, ENXIO, EOVERFLOW,
      * or ESPIPE is possible. */
-    const off_t src_orig_pos = lseek(src_fd, 0, SEEK_CUR);
-    const off_t dest_orig_pos = lseek(dest_fd, 0, SEEK_CUR);
+    const off_t src_pos = lseek(src_fd, 0, SEEK_CUR);
+    const off_t dest_pos = lseek(dest_fd, 0, SEEK_CUR);
 
-    /* Buffer size is selected to minimize the overhead from system calls.
-     * The value is picked based on coreutils cp(1) benchmarking data described
-     * here:
-     * https://github.com/coreutils/coreutils/blob/d1b0257077c0b0f0ee25087efd46270345d1dd1f/src/ioblksize.h#L23-L72 */
-    char buf[256u * 1024u];
-    bool ret = false;
+    if (copy_range(src_fd, src_pos, dest_fd, dest_pos, SSIZE_MAX) == -1) {
+        return false;
+    }
 
-    for (;;) {
-        ssize_t rcount = read_eintr(src_fd, buf, sizeof buf);
-        
-        if (rcount == 0) {
-            ret = true;
-            goto restore; 
-        }
+    return sync_dest(dest_fd, options);
+}
 
-        if (rcount == -1 
-            || write_all(dest_fd, buf, (size_t) rcount) == -1) {
-            goto restore;
-        }
+/**
+ * Validates src_fd and dest_fd for a range copy: both must be valid, refer to
+ * regular files or symbolic links, and not refer to the same file, and dest_fd
+ * must not be in append mode. On success, the status of the source file is
+ * stored in src_st. */
+[[gnu::nonnull]] static bool check_range_fds(int src_fd, int dest_fd,
+                                             struct stat src_st[static 1])
+{
+    if (!is_fd_valid(src_fd) || !is_fd_valid(dest_fd)) {
+        return false;
     }
 
-  restore:
-    lseek(src_fd, src_orig_pos, SEEK_SET);
-    lseek(dest_fd, dest_orig_pos, SEEK_SET);
+    /* On some systems (e.g. Linux), pwrite() ignores the offset on a file
+     * descriptor in append mode, and writes to the end of the file. The data
+     * would land somewhere other than the caller asked for. */
+    const int fl = fcntl(dest_fd, F_GETFL);
 
-    if (!ret) {
+    if (fl == -1 || (fl & O_APPEND) != 0) {
         return false;
     }
 
-    if ((options & (UNIX_SYNCHRONIZE_DATA | UNIX_SYNCHRONIZE)) != UNIX_NONE) {
-        return (options & UNIX_SYNCHRONIZE_DATA) != UNIX_NONE
-            ? fdatasync_eintr(dest_fd) != -1
-            : fsync_eintr(dest_fd) != -1;
+    struct stat dest_st;
+
+    return likely(fstat(src_fd, src_st) != -1)
+        && (is_mode_regular_file(src_st->st_mode) || is_mode_symlink(src_st->st_mode))
+        && likely(fstat(dest_fd, &dest_st) != -1)
+        && (is_mode_regular_file(dest_st.st_mode) || is_mode_symlink(dest_st.st_mode))
+        && likely(!is_equivalent_stat(src_st, &dest_st));
+}
+
+ssize_t unix_fcopy_file_range(int src_fd, off_t src_off, int dest_fd, 
+                              off_t dest_off, size_t len, unsigned char options)
+{
+    if (!are_options_valid(options)) {
+        return -1;
     }
-    
-    return true;
+
+    if (src_off < 0 || dest_off < 0) {
+        return -1;
+    }
+
+    struct stat src_st;
+
+    if (!check_range_fds(src_fd, dest_fd, &src_st)) {
+        return -1;
+    }
+
+    /* So that the byte count fits in the return value. */
+    if (len > SSIZE_MAX) {
+        len = SSIZE_MAX;
+    }
+
+    posix_fadvise(src_fd, src_off, (off_t) len, POSIX_FADV_SEQUENTIAL);
+
+    const ssize_t ret = copy_range(src_fd, src_off, dest_fd, dest_off, len);
+
+    if (ret == -1) {
+        return -1;
+    }
+
+    return sync_dest(dest_fd, options) ? ret : -1;
+}
+
+ssize_t unix_fappend_file(int src_fd, int dest_fd, off_t since, unsigned char options)
+{
+    if (!are_options_valid(options)) {
+        return -1;
+    }
+
+    struct stat src_st;
+    struct stat dest_st;
+
+    /* A source smaller than since has been truncated or replaced since the
+     * last copy, and the bytes before since can no longer be trusted. So has a
+     * destination smaller than since, and copying to it would leave a hole
+     * before the new bytes. */
+    if (since < 0 
+        || !check_range_fds(src_fd, dest_fd, &src_st)
+        || src_st.st_size < since
+        || unlikely(fstat(dest_fd, &dest_st) == -1)
+        || dest_st.st_size < since) {
+        return -1;
+    }
+
+    posix_fadvise(src_fd, since, 0, POSIX_FADV_SEQUENTIAL);
+
+    /* Copy up to the end of the file rather than to src_st.st_size, so that
+     * bytes appended after the fstat() above are picked up too. */
+    const ssize_t ret = copy_range(src_fd, since, dest_fd, since, SSIZE_MAX);
+
+    if (ret == -1) {
+        return -1;
+    }
+
+    /* Drop any stale tail left in the destination by an earlier, longer copy,
+     * so that it ends exactly where the source did. */
+    const off_t end = since + (off_t) ret;
+
+    if (unlikely(fstat(dest_fd, &dest_st) == -1)
+        || (dest_st.st_size > end && ftruncate(dest_fd, end) == -1)) {
+        return -1;
+    }
+
+    return sync_dest(dest_fd, options) ? ret : -1;
 }
 
 /** 
@@ -281,30 +487,19 @@ static bool preallocate_storage(int fd, off_t len)
 #endif  /* HAVE_FALLOCATE */
 }
 
-bool unix_copy_file(const char src_path[restrict static 1], 
-                    const char dest_path[restrict static 1],
-                    unsigned char options)
+/**
+ * Copies the file corresponding to src_fd to dest_path, creating or
+ * overwriting it as directed by options, like unix_copy_file() does. src_fd is
+ * not closed. */
+[[gnu::nonnull]] static bool copy_fd_to_path(int src_fd, 
+                                             const char dest_path[static 1],
+                                             unsigned char options)
 {
-    if (((options & UNIX_SKIP_EXISTING) != UNIX_NONE 
-            && (options & UNIX_OVERWRITE_EXISTING) != UNIX_NONE)
-        || ((options & UNIX_SYNCHRONIZE) != UNIX_NONE 
-            && (options & UNIX_SYNCHRONIZE_DATA) != UNIX_NONE)) {
-        return false;
-    }
-
-    int src_fd;
-
-    /* open() follows symlinks by default. */
-    if (src_fd = open(src_path, O_RDONLY), src_fd == -1) {
-        return false;
-    }
-
     int opts = O_WRONLY;
     int dest_fd;
 
     if (dest_fd = open(dest_path, opts), dest_fd == -1) {
         if (errno != ENOENT) {
-            close_eintr(src_fd);
             return false;
         }
 
@@ -319,11 +514,9 @@ bool unix_copy_file(const char src_path[restrict static 1],
         if (dest_fd = open(dest_path, opts, 0640), dest_fd == -1) {
             if (errno == EEXIST && (options & UNIX_SKIP_EXISTING) != UNIX_NONE) {
                 /* Do nothing. */
-                close_eintr(src_fd);
                 return false;            
             }
 
-            close_eintr(src_fd);
             return false;
         }
     }
@@ -333,15 +526,26 @@ bool unix_copy_file(const char src_path[restrict static 1],
     /* unix_fcopy_file() calls fstat() too. Can we somehow reduce one syscall? */
     if (fstat(dest_fd, &st) == -1
         || (!preallocate_storage(dest_fd, st.st_size) && (errno == EIO || errno == ENOSPC))) {
-        close_eintr(src_fd);
         close_eintr(dest_fd);
         return false;
     }
     
-    const bool ret = unix_fcopy_file(src_fd, dest_fd, options);
-    
-    /* Ignore errors on read-only file. */
-    close_eintr(src_fd);
+    /* Synchronize only after the destination has been truncated below, so that
+     * its new size reaches permanent storage too. */
+    const unsigned char sync_options = options & (UNIX_SYNCHRONIZE_DATA | UNIX_SYNCHRONIZE);
+    bool ret = unix_fcopy_file(src_fd, dest_fd, options & ~sync_options);
+
+    /* An existing destination file that was longer than the source would
+     * otherwise keep its old tail. */
+    if (ret) {
+        struct stat src_st;
+
+        ret = fstat(src_fd, &src_st) != -1 
+            && fstat(dest_fd, &st) != -1
+            && (st.st_size <= src_st.st_size || ftruncate(dest_fd, src_st.st_size) != -1);
+    }
+
+    ret = ret && sync_dest(dest_fd, sync_options);
     
     if (close_eintr(dest_fd) == -1) {
         /* EINPROGRESS is an allowed error code in future POSIX revisions,
@@ -353,3 +557,662 @@ bool unix_copy_file(const char src_path[restrict static 1],
     
     return ret;
 }
+
+bool unix_copy_file(const char src_path[restrict static 1], 
+                    const char dest_path[restrict static 1],
+                    unsigned char options)
+{
+    if (!are_options_valid(options)) {
+        return false;
+    }
+
+    int src_fd;
+
+    /* open() follows symlinks by default. */
+    if (src_fd = open(src_path, O_RDONLY), src_fd == -1) {
+        return false;
+    }
+
+    const bool ret = copy_fd_to_path(src_fd, dest_path, options);
+    
+    /* Ignore errors on read-only file. */
+    close_eintr(src_fd);
+    
+    return ret;
+}
+
+/* The manifest is a memory-mapped, open-addressed hash table keyed on the
+ * (st_dev, st_ino) pair of each source file and a hash of the path it was
+ * copied to. Keying on the source alone would let hard links to one file share
+ * a record, so that copying one of them would mark all their destinations as
+ * up to date. It is stored in native byte order
+ * and is not meant to be moved between machines; a manifest that fails
+ * validation is discarded, which only costs a full copy. */
+#define MANIFEST_MAGIC              "UCFMNFST"
+#define MANIFEST_VERSION            2u
+#define MANIFEST_MIN_CAPACITY       1024u
+
+/* Set in the header while the manifest is open. A manifest found with this flag
+ * set was not closed cleanly, and its records cannot be trusted. */
+#define MANIFEST_DIRTY              0b0000'0001u
+
+#define RECORD_USED                 0b0000'0001u
+/* The file was modified too close to the time it was recorded for its
+ * timestamps to prove that it has not been modified since. Its contents must be
+ * hashed to find out. */
+#define RECORD_RACY                 0b0000'0010u
+
+struct manifest_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t capacity;      /* Always a power of 2. */
+};
+
+struct manifest_key {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t dest;          /* Hash of the destination path. */
+};
+
+struct manifest_record {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t dest;
+    int64_t size;
+    int64_t mtime_ns;
+    int64_t ctime_ns;
+    uint64_t hash;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct unix_manifest {
+    int fd;
+    char *path;
+    struct manifest_header *hdr;
+    struct manifest_record *records;
+    size_t map_size;
+    /* One bit per slot, set for the records that unix_copy_file_manifest() has
+     * found up to date or written since the manifest was opened. Kept out of
+     * the mapping, so that skipping a file dirties no page of the manifest. */
+    uint64_t *seen;
+};
+
+[[gnu::always_inline, gnu::const]] static inline size_t manifest_file_size(uint64_t capacity)
+{
+    return sizeof (struct manifest_header) + capacity * sizeof (struct manifest_record);
+}
+
+[[gnu::always_inline, gnu::pure]] static inline int64_t timespec_to_ns(const struct timespec ts[static 1])
+{
+    return (int64_t) ts->tv_sec * 1'000'000'000 + ts->tv_nsec;
+}
+
+[[gnu::always_inline, gnu::pure]] static inline int64_t stat_mtime_ns(const struct stat st[static 1])
+{
+#if defined(__APPLE__) && defined(__MACH__)
+    return timespec_to_ns(&st->st_mtimespec);
+#else
+    return timespec_to_ns(&st->st_mtim);
+#endif  /* defined(__APPLE__) && defined(__MACH__) */
+}
+
+[[gnu::always_inline, gnu::pure]] static inline int64_t stat_ctime_ns(const struct stat st[static 1])
+{
+#if defined(__APPLE__) && defined(__MACH__)
+    return timespec_to_ns(&st->st_ctimespec);
+#else
+    return timespec_to_ns(&st->st_ctim);
+#endif  /* defined(__APPLE__) && defined(__MACH__) */
+}
+
+[[gnu::always_inline, gnu::const]] static inline uint64_t mix64(uint64_t h)
+{
+    /* The finalizer of MurmurHash3. */
+    h ^= h >> 33;
+    h *= 0xFF51'AFD7'ED55'8CCDu;
+    h ^= h >> 33;
+    h *= 0xC4CE'B9FE'1A85'EC53u;
+    h ^= h >> 33;
+    return h;
+}
+
+[[gnu::nonnull, gnu::pure]] static uint64_t hash_path(const char path[static 1])
+{
+    /* 64-bit FNV-1a. */
+    uint64_t h = 0xCBF2'9CE4'8422'2325u;
+
+    for (; *path != '\0'; ++path) {
+        h = (h ^ (unsigned char) *path) * 0x100'0000'01B3u;
+    }
+
+    return mix64(h);
+}
+
+[[gnu::nonnull, gnu::pure]] static struct manifest_key make_key(const struct stat st[static 1],
+                                                                const char dest_path[static 1])
+{
+    return (struct manifest_key) {
+        .dev = (uint64_t) st->st_dev,
+        .ino = (uint64_t) st->st_ino,
+        .dest = hash_path(dest_path),
+    };
+}
+
+/**
+ * Returns the record for key, or the empty slot where it would be inserted if
+ * there is none. There is always at least one empty slot, as the table is grown
+ * before it fills up. */
+[[gnu::nonnull, gnu::pure]] static struct manifest_record *manifest_slot(
+        const struct unix_manifest m[static 1], const struct manifest_key key[static 1])
+{
+    const uint64_t mask = m->hdr->capacity - 1;
+
+    for (uint64_t i = mix64(key->dev ^ mix64(key->ino ^ key->dest)) & mask;; i = (i + 1) & mask) {
+        struct manifest_record *const rec = &m->records[i];
+
+        if ((rec->flags & RECORD_USED) == 0 
+            || (rec->dev == key->dev && rec->ino == key->ino && rec->dest == key->dest)) {
+            return rec;
+        }
+    }
+}
+
+[[gnu::nonnull]] static void manifest_mark_seen(struct unix_manifest m[static 1],
+                                               const struct manifest_record rec[static 1])
+{
+    const uint64_t i = (uint64_t) (rec - m->records);
+
+    m->seen[i / 64] |= UINT64_C(1) << (i % 64);
+}
+
+[[gnu::nonnull, gnu::pure]] static bool manifest_is_seen(const struct unix_manifest m[static 1],
+                                                         uint64_t i)
+{
+    return (m->seen[i / 64] & (UINT64_C(1) << (i % 64))) != 0;
+}
+
+/**
+ * Takes an exclusive lock on the whole manifest file open on fd, without
+ * waiting for it.
+ *
+ * Where available (Linux 3.15+), the lock belongs to the open file description
+ * rather than to the process. It then conflicts with another open of the same
+ * manifest in this process too, and is not dropped when some other file
+ * descriptor for the file is closed. Classic POSIX record locks do neither. */
+static bool lock_manifest(int fd)
+{
+    /* l_pid must be 0 for open file description locks. */
+    struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+
+#ifdef F_OFD_SETLK
+    return fcntl(fd, F_OFD_SETLK, &lock) != -1;
+#else
+    return fcntl(fd, F_SETLK, &lock) != -1;
+#endif  /* F_OFD_SETLK */
+}
+
+/**
+ * Maps the manifest file open on fd, which must be exactly size bytes long. */
+[[gnu::nonnull]] static bool manifest_map(struct unix_manifest m[static 1], int fd, size_t size)
+{
+    void *const map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (map == MAP_FAILED) {
+        return false;
+    }
+
+    m->fd = fd;
+    m->hdr = map;
+    m->records = (struct manifest_record *) ((char *) map + sizeof *m->hdr);
+    m->map_size = size;
+    return true;
+}
+
+/**
+ * Writes the header of the manifest back to permanent storage. 
+ *
+ * The dirty flag must reach the disk before any record written after it is
+ * set does; otherwise, after a system crash, the manifest could look clean
+ * while holding records that were never completed. */
+[[gnu::nonnull]] static bool manifest_sync_header(const struct unix_manifest m[static 1])
+{
+    /* The header is at the start of the mapping, so it is page-aligned. */
+    return msync(m->hdr, sizeof *m->hdr, MS_SYNC) != -1;
+}
+
+/**
+ * Sizes the file open on fd for an empty, dirty table of the given capacity,
+ * and maps it. */
+[[gnu::nonnull]] static bool manifest_init(struct unix_manifest m[static 1], int fd,
+                                           uint64_t capacity)
+{
+    const size_t size = manifest_file_size(capacity);
+
+    /* Truncating to 0 first zeroes all the records. */
+    if (ftruncate(fd, 0) == -1 
+        || ftruncate(fd, (off_t) size) == -1
+        || !manifest_map(m, fd, size)) {
+        return false;
+    }
+
+    memcpy(m->hdr->magic, MANIFEST_MAGIC, sizeof m->hdr->magic);
+    m->hdr->version = MANIFEST_VERSION;
+    m->hdr->flags = MANIFEST_DIRTY;
+    m->hdr->count = 0;
+    m->hdr->capacity = capacity;
+
+    if (!manifest_sync_header(m)) {
+        munmap(m->hdr, m->map_size);
+        return false;
+    }
+
+    return true;
+}
+
+[[gnu::nonnull, gnu::pure]] static bool is_manifest_valid(const struct manifest_header hdr[static 1], 
+                                                          off_t size)
+{
+    return memcmp(hdr->magic, MANIFEST_MAGIC, sizeof hdr->magic) == 0
+        && hdr->version == MANIFEST_VERSION
+        && (hdr->flags & MANIFEST_DIRTY) == 0
+        && hdr->capacity >= MANIFEST_MIN_CAPACITY
+        && (hdr->capacity & (hdr->capacity - 1)) == 0
+        && hdr->count < hdr->capacity
+        && (uint64_t) size == manifest_file_size(hdr->capacity);
+}
+
+/**
+ * Rebuilds the table with the given capacity, keeping every record, or only
+ * those seen since the manifest was opened if only_seen is true. capacity must
+ * leave the table at most 3/4 full. 
+ *
+ * The new table is built in a temporary file that then replaces the manifest,
+ * so that a failure leaves the old one intact. */
+[[gnu::nonnull]] static bool manifest_rebuild(struct unix_manifest m[static 1], 
+                                              uint64_t capacity, bool only_seen)
+{
+    const size_t len = strlen(m->path);
+    char *const tmp_path = malloc(len + sizeof ".tmp");
+    uint64_t *const seen = calloc(capacity / 64, sizeof *seen);
+
+    if (tmp_path == nullptr || seen == nullptr) {
+        free(tmp_path);
+        free(seen);
+        return false;
+    }
+
+    memcpy(tmp_path, m->path, len);
+    memcpy(tmp_path + len, ".tmp", sizeof ".tmp");
+
+    const int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    struct unix_manifest new_m = { .path = m->path, .seen = seen };
+
+    if (fd == -1) {
+        free(tmp_path);
+        free(seen);
+        return false;
+    }
+
+    if (!manifest_init(&new_m, fd, capacity)) {
+        goto fail;
+    }
+
+    for (uint64_t i = 0; i < m->hdr->capacity; ++i) {
+        if ((m->records[i].flags & RECORD_USED) == 0 
+            || (only_seen && !manifest_is_seen(m, i))) {
+            continue;
+        }
+
+        const struct manifest_key key = { 
+            .dev = m->records[i].dev,
+            .ino = m->records[i].ino,
+            .dest = m->records[i].dest,
+        };
+        struct manifest_record *const rec = manifest_slot(&new_m, &key);
+
+        *rec = m->records[i];
+        ++new_m.hdr->count;
+
+        if (manifest_is_seen(m, i)) {
+            manifest_mark_seen(&new_m, rec);
+        }
+    }
+
+    if (!lock_manifest(fd) || rename(tmp_path, m->path) == -1) {
+        munmap(new_m.hdr, new_m.map_size);
+        goto fail;
+    }
+
+    free(tmp_path);
+    free(m->seen);
+    munmap(m->hdr, m->map_size);
+    close_eintr(m->fd);
+    *m = new_m;
+    return true;
+
+  fail:
+    unlink(tmp_path);
+    free(tmp_path);
+    free(seen);
+    close_eintr(fd);
+    return false;
+}
+
+struct unix_manifest *unix_manifest_open(const char path[static 1])
+{
+    struct unix_manifest *const m = malloc(sizeof *m);
+
+    if (m == nullptr) {
+        return nullptr;
+    }
+
+    const size_t len = strlen(path);
+
+    if (m->path = malloc(len + 1), m->path == nullptr) {
+        free(m);
+        return nullptr;
+    }
+
+    memcpy(m->path, path, len + 1);
+
+    const int fd = open(path, O_RDWR | O_CREAT, 0600);
+
+    if (fd == -1) {
+        goto fail;
+    }
+
+    /* Two concurrent runs with the same manifest would corrupt it. */
+    struct stat st;
+
+    if (!lock_manifest(fd) || fstat(fd, &st) == -1) {
+        close_eintr(fd);
+        goto fail;
+    }
+
+    if ((size_t) st.st_size >= manifest_file_size(MANIFEST_MIN_CAPACITY)
+        && manifest_map(m, fd, (size_t) st.st_size)) {
+        if (is_manifest_valid(m->hdr, st.st_size)) {
+            m->hdr->flags |= MANIFEST_DIRTY;
+
+            if (!manifest_sync_header(m)) {
+                munmap(m->hdr, m->map_size);
+                close_eintr(fd);
+                goto fail;
+            }
+
+            goto alloc_seen;
+        }
+
+        munmap(m->hdr, m->map_size);
+    }
+
+    /* Missing, stale, or left dirty by an interrupted run. Start afresh. */
+    if (!manifest_init(m, fd, MANIFEST_MIN_CAPACITY)) {
+        close_eintr(fd);
+        goto fail;
+    }
+
+  alloc_seen:
+    if (m->seen = calloc(m->hdr->capacity / 64, sizeof *m->seen), m->seen == nullptr) {
+        munmap(m->hdr, m->map_size);
+        close_eintr(fd);
+        goto fail;
+    }
+
+    return m;
+
+  fail:
+    free(m->path);
+    free(m);
+    return nullptr;
+}
+
+bool unix_manifest_close(struct unix_manifest *manifest)
+{
+    if (manifest == nullptr) {
+        return true;
+    }
+
+    /* Write the records back before clearing the dirty flag, so that the flag
+     * never reaches the disk ahead of them. */
+    bool ret = msync(manifest->hdr, manifest->map_size, MS_SYNC) != -1;
+
+    if (ret) {
+        manifest->hdr->flags &= ~MANIFEST_DIRTY;
+        ret = manifest_sync_header(manifest);
+    }
+
+    munmap(manifest->hdr, manifest->map_size);
+    
+    if (close_eintr(manifest->fd) == -1 && errno != EINTR && errno != EINPROGRESS) {
+        ret = false;
+    }
+
+    free(manifest->seen);
+    free(manifest->path);
+    free(manifest);
+    return ret;
+}
+
+bool unix_manifest_prune(struct unix_manifest *manifest)
+{
+    uint64_t live = 0;
+
+    for (uint64_t i = 0; i < manifest->hdr->capacity; ++i) {
+        live += (manifest->records[i].flags & RECORD_USED) != 0 && manifest_is_seen(manifest, i);
+    }
+
+    if (live == manifest->hdr->count) {
+        return true;
+    }
+
+    /* Shrink the table too, if the records that remain fit in a smaller one. */
+    uint64_t capacity = MANIFEST_MIN_CAPACITY;
+
+    while (live * 4 > capacity * 3) {
+        capacity *= 2;
+    }
+
+    return manifest_rebuild(manifest, capacity, true);
+}
+
+/**
+ * Hashes the first size bytes of the file corresponding to fd. This is not a
+ * cryptographic hash; it detects changes that leave the size and timestamps of a
+ * file untouched, not deliberate collisions.
+ *
+ * Returns false on a read error, or if the file is shorter than size bytes. */
+[[gnu::nonnull]] static bool hash_fd(int fd, off_t size, uint64_t hash[static 1])
+{
+    char buf[256u * 1024u];
+    uint64_t h = mix64((uint64_t) size);
+    off_t off = 0;
+
+    while (off < size) {
+        const size_t want = size - off < (off_t) sizeof buf ? (size_t) (size - off) : sizeof buf;
+        size_t got = 0;
+
+        /* Fill the buffer completely, so that the result does not depend on
+         * where short reads split the data. */
+        while (got < want) {
+            const ssize_t rcount = pread_eintr(fd, buf + got, want - got, off + (off_t) got);
+
+            if (rcount <= 0) {
+                return false;
+            }
+
+            got += (size_t) rcount;
+        }
+
+        size_t i = 0;
+
+        for (; i + sizeof (uint64_t) <= got; i += sizeof (uint64_t)) {
+            uint64_t w;
+
+            memcpy(&w, buf + i, sizeof w);
+            h = (h ^ mix64(w)) * 0x9E37'79B9'7F4A'7C15u;
+        }
+
+        for (; i < got; ++i) {
+            h = (h ^ (unsigned char) buf[i]) * 0x100'0000'01B3u;
+        }
+
+        off += (off_t) got;
+    }
+
+    *hash = mix64(h);
+    return true;
+}
+
+[[gnu::nonnull, gnu::pure]] static bool is_record_current(const struct manifest_record rec[static 1],
+                                                          const struct stat st[static 1])
+{
+    return (rec->flags & RECORD_USED) != 0
+        && rec->size == st->st_size
+        && rec->mtime_ns == stat_mtime_ns(st)
+        && rec->ctime_ns == stat_ctime_ns(st);
+}
+
+/**
+ * Records st and hash for the source file under key, growing the table if
+ * needed. start_ns is the time at which the copy began. */
+[[gnu::nonnull]] static bool manifest_put(struct unix_manifest m[static 1],
+                                          const struct manifest_key key[static 1],
+                                          const struct stat st[static 1],
+                                          uint64_t hash, int64_t start_ns)
+{
+    struct manifest_record *rec = manifest_slot(m, key);
+
+    if ((rec->flags & RECORD_USED) == 0) {
+        /* Keep the load factor at or below 3/4. */
+        if ((m->hdr->count + 1) * 4 > m->hdr->capacity * 3) {
+            if (!manifest_rebuild(m, m->hdr->capacity * 2, false)) {
+                return false;
+            }
+
+            rec = manifest_slot(m, key);
+        }
+
+        ++m->hdr->count;
+    }
+
+    const int64_t mtime_ns = stat_mtime_ns(st);
+    const int64_t ctime_ns = stat_ctime_ns(st);
+
+    /* Filesystem timestamps may be far coarser than a nanosecond. A write sets
+     * both timestamps to the current tick, so it goes unnoticed only if both
+     * were already in that tick; if either is older, the write changes it. The
+     * timestamps therefore only prove anything if the older one's tick had
+     * passed before the copy began. Allow a full second, the coarsest
+     * granularity in common use. */
+    const bool racy = (mtime_ns < ctime_ns ? mtime_ns : ctime_ns) > start_ns - 1'000'000'000;
+
+    *rec = (struct manifest_record) {
+        .dev = key->dev,
+        .ino = key->ino,
+        .dest = key->dest,
+        .size = st->st_size,
+        .mtime_ns = mtime_ns,
+        .ctime_ns = ctime_ns,
+        .hash = hash,
+        .flags = RECORD_USED | (racy ? RECORD_RACY : 0),
+    };
+    manifest_mark_seen(m, rec);
+    return true;
+}
+
+bool unix_copy_file_manifest(struct unix_manifest *manifest,
+                             const char src_path[restrict static 1], 
+                             const char dest_path[restrict static 1],
+                             unsigned char options)
+{
+    if (!are_options_valid(options)) {
+        return false;
+    }
+
+    struct stat st;
+
+    if (stat(src_path, &st) == -1) {
+        return false;
+    }
+
+    struct manifest_key key = make_key(&st, dest_path);
+    const struct manifest_record *rec = manifest_slot(manifest, &key);
+
+    /* The common case: the source has not changed since it was last copied. */
+    if (is_record_current(rec, &st) && (rec->flags & RECORD_RACY) == 0) {
+        manifest_mark_seen(manifest, rec);
+        return true;
+    }
+
+    struct timespec now;
+
+    if (clock_gettime(CLOCK_REALTIME, &now) == -1) {
+        return false;
+    }
+
+    const int64_t start_ns = timespec_to_ns(&now);
+    int src_fd;
+
+    if (src_fd = open(src_path, O_RDONLY), src_fd == -1) {
+        return false;
+    }
+
+    /* src_path may have been replaced or modified since the stat() above.
+     * From here on, only trust what we know about the file we actually have
+     * open. */
+    bool ret = false;
+
+    if (fstat(src_fd, &st) == -1 || !is_mode_regular_file(st.st_mode)) {
+        goto out;
+    }
+
+    key = make_key(&st, dest_path);
+    rec = manifest_slot(manifest, &key);
+
+    /* Hash the source before copying it, not after. A write during the copy
+     * may leave the timestamps unchanged if it falls in the same clock tick,
+     * and then a hash taken afterwards would describe the new contents while
+     * the destination holds a mix. A hash taken before can only be older than
+     * the source, and so fails to match on the next run. */
+    uint64_t hash = 0;
+    const bool hashed = hash_fd(src_fd, st.st_size, &hash);
+
+    /* Only the timestamps changed, or were too recent to be trusted, and the
+     * contents are the same. There is nothing to copy. */
+    const bool unchanged = hashed 
+        && (rec->flags & RECORD_USED) != 0 
+        && rec->size == st.st_size 
+        && rec->hash == hash;
+
+    if (!unchanged && !copy_fd_to_path(src_fd, dest_path, options)) {
+        goto out;
+    }
+
+    if (!hashed) {
+        /* The source shrank while it was being hashed. The next run will copy
+         * it again. */
+        ret = true;
+        goto out;
+    }
+
+    struct stat after;
+
+    /* Only record the file if it was not modified while it was being copied;
+     * otherwise the destination may hold a mix of the old and new contents,
+     * which the next run must replace. */
+    ret = fstat(src_fd, &after) != -1;
+
+    if (ret && after.st_size == st.st_size
+        && stat_mtime_ns(&after) == stat_mtime_ns(&st) 
+        && stat_ctime_ns(&after) == stat_ctime_ns(&st)) {
+        ret = manifest_put(manifest, &key, &st, hash, start_ns);
+    }
+
+  out:
+    close_eintr(src_fd);
+    return ret;
+}
@@ -57,12 +57,14 @@
  *       returns, at the point of physically writing the data to the underlying
  *       media, and this error shall not be reported to the caller.
  *
- *     - This copying is not done within the kernel, and would require 
- *       transferring data to and from user space. But it is portable across 
- *       all UNIX-like systems. 
+ *     - Where available (Linux), the copying is offloaded to the kernel with
+ *       copy_file_range(). Elsewhere, or where the filesystem does not support
+ *       it, the data is transferred to and from user space, which is portable
+ *       across all UNIX-like systems. 
  *
- *     - The seek position of both the source file descriptor and the
- *       destination file descriptors are restored before returning.
+ *     - The data is copied from the seek position of the source file
+ *       descriptor to the seek position of the destination file descriptor.
+ *       Neither seek position is modified.
  *
  *     - Symbolic links are followed. */
 [[nodiscard, gnu::nonnull]] bool unix_copy_file(const char src_path[restrict static 1], 
@@ -78,8 +80,220 @@
  * options:   Copy options. 
  *
  * Note: 
- *     If dest_path does not exist, and (options & UNIX_SKIP_EXISTING) ==
- *     UNIX_NONE, the file is created. */
+ *     - If dest_path does not exist, and (options & UNIX_SKIP_EXISTING) ==
+ *       UNIX_NONE, the file is created.
+ *
+ *     - If dest_path exists and is longer than the source file, it is
+ *       truncated to the size of the source file, before any synchronization
+ *       requested by options. */
 [[nodiscard]] bool unix_fcopy_file(int src_fd, int dest_fd, unsigned char options);
 
+/**
+ * unix_fcopy_file_range() copies at most len bytes from src_fd, starting at
+ * byte offset src_off, to dest_fd, starting at byte offset dest_off.
+ *
+ * src_fd:   A file descriptor opened for reading.
+ * src_off:  Offset in the source file to start reading from.
+ * dest_fd:  A file descriptor opened for writing.
+ * dest_off: Offset in the destination file to start writing at.
+ * len:      Maximum number of bytes to copy.
+ * options:  Copy options. Only UNIX_SYNCHRONIZE and UNIX_SYNCHRONIZE_DATA have
+ *           an effect.
+ *
+ * Effects: 
+ *     Fail if:
+ *       - src_off or dest_off is negative.
+ *       - src_fd or dest_fd is invalid, or does not correspond to a regular
+ *         file or symbolic link.
+ *       - dest_fd was opened with O_APPEND.
+ *       - src_fd and dest_fd correspond to the same file.
+ *       - Both UNIX_OVERWRITE_EXISTING and UNIX_SKIP_EXISTING are set.
+ *       - Both UNIX_SYNCHRONIZE and UNIX_SYNCHRONIZE_DATA are set.
+ *
+ *     Otherwise, the bytes [src_off, src_off + len) of the file corresponding
+ *     to src_fd, or as many of them as exist, are written to the file
+ *     corresponding to dest_fd at [dest_off, dest_off + len), and the data is
+ *     synchronized as with unix_fcopy_file(). The size of the destination
+ *     file is extended, but never reduced. File attributes are not copied.
+ *
+ * Returns:
+ *     The number of bytes copied, which is less than len only if the end of the
+ *     source file was reached, or -1 on error. 
+ *
+ * Note:
+ *     - Where available (Linux), the copy is offloaded to the kernel with
+ *       copy_file_range(), falling back to copying through user space.
+ *
+ *     - Positional I/O is used throughout, so the seek positions of src_fd and
+ *       dest_fd are neither used nor modified, and the file descriptors may be
+ *       shared with other threads.
+ *
+ *     - O_APPEND destinations are refused because some systems (e.g. Linux)
+ *       ignore the offset given to pwrite() for them, and would append the
+ *       data to the end of the file instead of writing it at dest_off. */
+[[nodiscard]] ssize_t unix_fcopy_file_range(int src_fd, off_t src_off,
+                                            int dest_fd, off_t dest_off,
+                                            size_t len, unsigned char options);
+
+/**
+ * unix_fappend_file() brings dest_fd up to date with a growing src_fd, given
+ * that the first since bytes have already been copied, e.g. by a previous call
+ * to unix_fcopy_file() or unix_fappend_file().
+ *
+ * src_fd:  A file descriptor opened for reading.
+ * dest_fd: A file descriptor opened for writing.
+ * since:   Size of the source file at the time of the last copy.
+ * options: Copy options, as for unix_fcopy_file_range().
+ *
+ * Effects: 
+ *     Fail if:
+ *       - since is negative, or greater than the size of the source file or
+ *         of the destination file.
+ *       - Any of the conditions listed for unix_fcopy_file_range() hold.
+ *
+ *     Otherwise, the bytes of the source file from since up to its end are
+ *     copied to the same offsets in the destination file. The destination file
+ *     is then truncated to the size of the source file, if it was larger.
+ *
+ * Returns:
+ *     The number of bytes copied, or -1 on error. since plus the return value
+ *     is the value of since to pass on the next call.
+ *
+ * Note:
+ *     - A failure because since is greater than the size of either file
+ *       usually means that it was truncated or rotated. The caller should fall
+ *       back to copying the whole file.
+ *
+ *     - The work done is proportional to the number of new bytes, and not the
+ *       size of the file.
+ *
+ *     - As with unix_fcopy_file_range(), seek positions are not modified. */
+[[nodiscard]] ssize_t unix_fappend_file(int src_fd, int dest_fd, off_t since,
+                                        unsigned char options);
+
+/**
+ * A manifest of the source files copied by previous calls to
+ * unix_copy_file_manifest(), which lets repeated copies of a mostly unchanged
+ * set of files skip the unchanged ones. */
+struct unix_manifest;
+
+/**
+ * unix_manifest_open() opens the manifest stored at path, creating it if it
+ * does not exist.
+ *
+ * path: Path to the manifest file.
+ *
+ * Effects: 
+ *     Fail if path cannot be opened or created, or if the manifest is already
+ *     open in another process. On systems with open file description locks
+ *     (Linux), also fail if it is already open in this process; elsewhere,
+ *     opening it twice in one process is not detected, and must be avoided.
+ *
+ *     Otherwise, the manifest is opened. If the file is empty, is not a valid
+ *     manifest, or was not closed by unix_manifest_close() (e.g. because the
+ *     process crashed), it is replaced by an empty manifest.
+ *
+ * Returns:
+ *     A pointer to the manifest, or a null pointer on error. The manifest
+ *     should be closed with unix_manifest_close().
+ *
+ * Note:
+ *     - The manifest is a binary hash table of 64-byte records, kept at most
+ *       three quarters full. It is memory-mapped rather than loaded, so opening
+ *       it takes constant time.
+ *       It is stored in native byte order, and is not portable across
+ *       machines. */
+[[nodiscard, gnu::nonnull]] struct unix_manifest *unix_manifest_open(const char path[static 1]);
+
+/**
+ * unix_manifest_close() writes the manifest back to permanent storage and
+ * closes it. 
+ *
+ * manifest: A manifest returned by unix_manifest_open(), or a null pointer, in
+ *           which case nothing is done.
+ *
+ * Returns:
+ *     true if the manifest was written without error, otherwise false. In
+ *     either case, the manifest is closed. */
+bool unix_manifest_close(struct unix_manifest *manifest);
+
+/**
+ * unix_manifest_prune() drops the records of manifest that no call to
+ * unix_copy_file_manifest() has found up to date or recorded since the
+ * manifest was opened, e.g. those of source files that were deleted or
+ * rotated away.
+ *
+ * manifest: A manifest returned by unix_manifest_open().
+ *
+ * Returns:
+ *     true if the manifest was pruned without error, otherwise false, in which
+ *     case it is left as it was.
+ *
+ * Note:
+ *     - Records are never dropped otherwise, so a manifest used for a changing
+ *       set of files grows with every source and destination pair it has ever
+ *       seen. Call unix_manifest_prune() after a run that passed every source
+ *       file that should be kept, before unix_manifest_close().
+ *
+ *     - A source file whose copy failed, or that was modified while it was
+ *       being copied, is not counted as seen, and is copied in full by the next
+ *       run after pruning.
+ *
+ *     - This takes time proportional to the size of the manifest, as the table
+ *       is rebuilt, and shrunk if the remaining records allow it. */
+[[nodiscard, gnu::nonnull]] bool unix_manifest_prune(struct unix_manifest *manifest);
+
+/**
+ * unix_copy_file_manifest() functions exactly the same as unix_copy_file(),
+ * except that it first looks the source file up in manifest, and does nothing
+ * if the file is unchanged since manifest recorded it.
+ *
+ * manifest:  A manifest returned by unix_manifest_open().
+ * src_path:  Path to the source file.
+ * dest_path: Path to the destination file.
+ * options:   Copy options. 
+ *
+ * Effects: 
+ *     The source file is identified by its device and inode numbers together
+ *     with dest_path, so hard links to one file copied to different
+ *     destinations are recorded separately. It is unchanged if its size,
+ *     modification time and status change time are the same as those
+ *     recorded. Such a file is not opened, and the call returns successfully.
+ *
+ *     Otherwise, the source file is opened and its contents hashed. If its size
+ *     and hash match the recorded ones, only the timestamps have changed, and
+ *     the copy is skipped. Otherwise, the file is copied as by
+ *     unix_copy_file().
+ *
+ *     The file is then recorded in manifest, unless it was modified while it
+ *     was being copied.
+ *
+ * Returns:
+ *     true if the destination file is up to date, otherwise false.
+ *
+ * Note:
+ *     - The manifest only describes source files. If a destination file may be
+ *       modified or removed by other means, the manifest should be removed to
+ *       force a full copy.
+ *
+ *     - Without UNIX_SYNCHRONIZE or UNIX_SYNCHRONIZE_DATA, the destination
+ *       data may still be in flight when the manifest is closed. After a
+ *       system crash, a cleanly closed manifest can then describe destination
+ *       files whose contents did not survive, and those files are skipped
+ *       until their sources change. Use one of these options if the manifest
+ *       must stay correct across crashes.
+ *
+ *     - On filesystems with coarse timestamps, a file whose modification and
+ *       status change times are both less than a second older than the copy
+ *       cannot be told apart from an unchanged one by its timestamps. Such a
+ *       file is hashed again on the next call.
+ *
+ *     - As with Boost's copy_options::update_existing, the check is not atomic
+ *       with the copy. A file modified after the check is copied on the next
+ *       call. */
+[[nodiscard, gnu::nonnull]] bool unix_copy_file_manifest(struct unix_manifest *manifest,
+                                                         const char src_path[restrict static 1], 
+                                                         const char dest_path[restrict static 1],
+                                                         unsigned char options);
+
 #endif /* UNIX_COPY_FILE_H */